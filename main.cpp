@@ -7,10 +7,12 @@
 #include <experimental/filesystem>  // canonnical(), path()
 #include <cstdlib>                  // exit()
 #include <cstring>                  // atoi()
+#include <limits>                   // numeric_limits
 #include <getopt.h>                 // getopt_long()
 #include <unistd.h>                 // _SC_NPROCESSORS_ONLN
 
 #include "primes.h"
+#include "profiler.h"
 
 // Прогресс бар
 class ProgressBar
@@ -51,8 +53,9 @@ private:
 
 namespace fs = std::experimental::filesystem;  // Для удобства объявим псевдоним fs для filesystem
 
-enum class what {check, factor, empty};        // check -- выполнить проверку на простоту, factor -- разложить число на
-// простые множители, empty -- отсутсвие параметра check либо factor
+enum class what {check, factor, calibrate, empty};  // check -- выполнить проверку на простоту, factor -- разложить
+// число на простые множители, calibrate -- подобрать пороги выбора алгоритмов под данную машину,
+// empty -- отсутсвие параметра check, factor либо calibrate
 
 void usage();                                  // <--- справка по использованию программы
 void help();                                   // <--- информация по опциям и параметрам программы
@@ -65,8 +68,10 @@ void help();                                   // <--- информация по
 //                        path (первый в списке) --- путь к к файлу в котором содердится список чисел для обработки,
 //                        path (второй в списке) --- путь к выходному файлу, в который будут записываться
 //                                                   результы работы программы
-//                        what --- содержит одно из трех перечислений, указывающих режим
-//                                 исполнения программы. см. enum what {check, factor, empty}
+//                        what --- содержит одно из четырех перечислений, указывающих режим
+//                                 исполнения программы. см. enum what {check, factor, calibrate, empty}
+//                        long --- колличество процессов из опции --scale, -1 если опция не указана
+//                 В режиме calibrate пути к файлам необязательны и могут быть пустыми.
 std::tuple<fs::path, fs::path, what, long> get_param(int argc, char * argv[]);
 
 
@@ -86,6 +91,20 @@ void factorization(std::istream & in, std::ostream & out);
 
 std::streamoff stream_size(std::istream & f);
 
+// bool read_token(std::istream & in, std::string & line) - функция, читающая из потока in очередное
+// число или диапазон в строку line. Время чтения учитывается профилировщиком как разбор входных данных.
+// Возвращаемое значение: true, если чтение прошло успешно, false - в противном случае
+bool read_token(std::istream & in, std::string & line);
+
+// std::string config_path() - функция, возвращающая путь к файлу с порогами выбора алгоритмов:
+// $HOME/.op-prime-number, либо .op-prime-number в текущей дерриктории, если HOME не задан.
+std::string config_path();
+
+// void calibrate(long nproc) - процедура подбора порогов выбора алгоритмов. Выводит найденные
+// пороги и сохраняет их в файл config_path(), откуда они загружаются при следующих запусках.
+// Принимаемые праметры: nproc - колличество процессов для параллельной проверки
+void calibrate(long nproc);
+
 
 ProgressBar progress_bar;
 
@@ -95,12 +114,20 @@ int main(int argc, char * argv[]) {
     // Вызываем get_param(), после чего распаковываем результат работы функции.
     const auto [in_path, out_path, task, num_proc] = get_param(argc, argv);
 
+    Prime::load_thresholds(config_path());
+    if (task == what::calibrate) {
+        calibrate(num_proc <= 0 ? sysconf(_SC_NPROCESSORS_ONLN): num_proc);
+        return 0;
+    }
+
     if (!fs::exists(in_path)) {  // Если у нас имеется не валидный путь к файлу
         std::cerr << "Invalid path to input. Path does not exist." << std::endl;
         std::exit(EXIT_FAILURE); // Выходим с ошибкой
     }
-    if (fs::is_empty(in_path))
+    if (fs::is_empty(in_path)) {
+        Profiler::report(std::cout, num_proc >= 0);
         return 0;
+    }
 
     std::ifstream in_file;
     std::ofstream out_file;
@@ -133,12 +160,14 @@ int main(int argc, char * argv[]) {
                 std::cerr << strerror(errno) << std::endl;  // Выводим значение errno
             else
                 std::cerr << e.what() << std::endl;         // Иначе это ошибка чтения из потока
+            Profiler::report(std::cout, num_proc >= 0);
             std::exit(EXIT_FAILURE);
         }
         if (out_file.tellp() == 0)
             out_file << " ----------------- No records --------------------";
     }
     std::cout << std::endl;
+    Profiler::report(std::cout, num_proc >= 0);
     return 0;
 }
 
@@ -148,6 +177,8 @@ void usage() {
               << "                    [-s | --scale [value: optional]: optional]" << std::endl
               << "                    [-с | --check: required]" << std::endl
               << "                    [-f | --factor: required]" << std::endl
+              << "                    [-C | --calibrate]" << std::endl
+              << "                    [-P | --profile: optional]" << std::endl
               << "type program_name [-h | --help]" << std::endl;
 }
 
@@ -163,7 +194,14 @@ void help() {
                  "The value of the option indicates how many processes to split the processing of the list of numbers.\n"
                  "If the value is not specified, "
                  "then the selection of the number of processes will occur automatically.\n"
-                 "Not supported in factorization mode" << std::endl;
+                 "Not supported in factorization mode\n"
+              << "[-C | --calibrate] - Benchmark the algorithms on this machine and save the chosen thresholds\n"
+                 "to " << config_path() << ". Later runs load them at startup. Options -p and -o are not needed.\n"
+                 "The value of the [-s | --scale] option (-s4 or --scale=4) sets the number of processes to calibrate for\n"
+              << "[-P | --profile] - Report wall time and hardware counters (cycles, instructions, cache misses,\n"
+                 "branch misses) for each phase: parse, primality test, trial factorization, rho and output.\n"
+                 "If the counters are unavailable, only wall time is reported. Not supported with [-C | --calibrate]"
+              << std::endl;
 }
 
 std::tuple<fs::path, fs::path, what, long> get_param(int argc, char * argv[]) {
@@ -171,11 +209,12 @@ std::tuple<fs::path, fs::path, what, long> get_param(int argc, char * argv[]) {
         usage();
         std::exit(EXIT_FAILURE);
     }
-    const char * short_options = "hp:o:s::cf";
+    const char * short_options = "hp:o:s::cfCP";
     const option long_options[] = {
             {"help", no_argument, nullptr, 'h'},         {"path", required_argument, nullptr, 'p'},
             {"output", required_argument, nullptr, 'o'}, {"scale", optional_argument, nullptr, 's'},
             {"check", no_argument, nullptr, 'c'},        {"factor", no_argument, nullptr, 'f'},
+            {"calibrate", no_argument, nullptr, 'C'},    {"profile", no_argument, nullptr, 'P'},
             {nullptr, 0, nullptr, 0}
     };
     int res{};
@@ -184,6 +223,7 @@ std::tuple<fs::path, fs::path, what, long> get_param(int argc, char * argv[]) {
     fs::path input{}, output{};
     int num_proc = -1;
     what task = what::empty;
+    bool profile = false;
     while ((res = getopt_long(argc, argv, short_options, long_options, &option_index)) != -1) {
         switch (res) {
             case 'h': help();          break;
@@ -191,6 +231,8 @@ std::tuple<fs::path, fs::path, what, long> get_param(int argc, char * argv[]) {
             case 'o': output = optarg; break;
             case 'c': task   = (task == what::empty ? what::check: task);  break;
             case 'f': task   = (task == what::empty ? what::factor: task); break;
+            case 'C': task   = (task == what::empty ? what::calibrate: task); break;
+            case 'P': profile = true; break;
             case 's': num_proc = (optarg ? atoi(optarg): 0);
                 break;
             case '?':
@@ -203,45 +245,66 @@ std::tuple<fs::path, fs::path, what, long> get_param(int argc, char * argv[]) {
         usage();
         std::exit(EXIT_FAILURE);
     }
+    if (task == what::calibrate && profile) {
+        std::cout << "calibration can not be profiled, profiling would distort its timings" << std::endl;
+        usage();
+        std::exit(EXIT_FAILURE);
+    }
+    if (task == what::calibrate)
+        return {input, output, task, num_proc};
     if (input.empty() || output.empty() || task == what::empty) {
         std::cout << "there are not enough options or options are incorrect" << std::endl;
         usage();
         std::exit(EXIT_FAILURE);
     }
+    if (profile)
+        Profiler::enable();
     return {input, output, task, num_proc};
 }
 
 
 
 void process_range(const std::string & range, std::ostream & out, const what & task, long nproc){
-    std::stringstream ss{range};
     numeric_t left, right;
-    char delim;
-    ss >> left >> delim >> right;
-    out << left << ":" << right << " ---> [ ";
+    {
+        Profiler::Scope scope(Profiler::phase::parse);
+        std::stringstream ss{range};
+        char delim;
+        ss >> left >> delim >> right;
+    }
+    {
+        Profiler::Scope scope(Profiler::phase::output);
+        out << left << ":" << right << " ---> [ ";
+    }
     if (task == what::check) {
         for (numeric_t num = left; num <= right; ++num) {
-            if (nproc) {
-                if (Prime::is_prime(num, nproc))
-                    out << num << " ";
+            bool prime;
+            {
+                Profiler::Scope scope(Profiler::phase::primality);
+                prime = (nproc ? Prime::is_prime(num, nproc): Prime::is_prime(num));
             }
-            else {
-                if (Prime::is_prime(num))
-                    out << num << " ";
+            if (prime) {
+                Profiler::Scope scope(Profiler::phase::output);
+                out << num << " ";
             }
         }
     }
     else {
         for (numeric_t num = left; num <= right; ++num) {
+            std::set<numeric_t> dividers;
+            if (num != 0)
+                dividers = Prime::factorization(num);
+            Profiler::Scope scope(Profiler::phase::output);
             out << "{ " << num << ": ";
             if (num != 0)
-                for (const auto & divider: Prime::factorization(num))
+                for (const auto & divider: dividers)
                     out << divider << " ";
             else
                 out << "any";
             out << "}";
         }
     }
+    Profiler::Scope scope(Profiler::phase::output);
     out << "]" << std::endl;
 }
 
@@ -251,7 +314,7 @@ void check_prime(std::istream & in, std::ostream & out, long nproc) {
     progress_bar.init(static_cast<unsigned long>(stream_size(in)), "Progress");
     std::size_t count_space = 0;
     std::string line;
-    while (in >> line) {
+    while (read_token(in, line)) {
         if (line.find(':') != std::string::npos) {
             if (nproc) {
                 process_range(line, out, what::check, nproc);
@@ -261,13 +324,20 @@ void check_prime(std::istream & in, std::ostream & out, long nproc) {
         }
         else {
             try {
-                if (nproc) {
-                    if (Prime::is_prime(std::stoll(line), nproc))
-                        out << line << std::endl;
+                numeric_t number;
+                {
+                    Profiler::Scope scope(Profiler::phase::parse);
+                    number = std::stoll(line);
+                }
+                bool prime;
+                {
+                    Profiler::Scope scope(Profiler::phase::primality);
+                    prime = (nproc ? Prime::is_prime(number, nproc): Prime::is_prime(number));
+                }
+                if (prime) {
+                    Profiler::Scope scope(Profiler::phase::output);
+                    out << line << std::endl;
                 }
-                else
-                    if (Prime::is_prime(std::stoll(line)))
-                        out << line << std::endl;
             }
             catch (std::logic_error & e) {
                 std::cout << std::endl << "Number: " << '\'' << line << "' Wrong format or type overflow. "
@@ -287,14 +357,20 @@ void factorization(std::istream & in, std::ostream & out) {
     std::size_t count_space = 0;
     std::string line;
 
-    while (in >> line) {
+    while (read_token(in, line)) {
         if (line.find(':') != std::string::npos)
             process_range(line, out, what::factor);
         else {
             try {
-                numeric_t number = std::stoll(line);
+                numeric_t number;
+                {
+                    Profiler::Scope scope(Profiler::phase::parse);
+                    number = std::stoll(line);
+                }
+                auto dividers = Prime::factorization(number);
+                Profiler::Scope scope(Profiler::phase::output);
                 out << line << ": ";
-                for (const auto &divider: Prime::factorization(number))
+                for (const auto &divider: dividers)
                     out << divider << " ";
                 out << std::endl;
             }
@@ -309,6 +385,11 @@ void factorization(std::istream & in, std::ostream & out) {
     }
 }
 
+bool read_token(std::istream & in, std::string & line) {
+    Profiler::Scope scope(Profiler::phase::parse);
+    return static_cast<bool>(in >> line);
+}
+
 std::streamoff stream_size(std::istream & f) {
     std::istream::pos_type current_pos = f.tellg();
     if (current_pos == -1)
@@ -317,4 +398,34 @@ std::streamoff stream_size(std::istream & f) {
     std::istream::pos_type end_pos = f.tellg();
     f.seekg(current_pos);
     return end_pos - current_pos;
-}
\ No newline at end of file
+}
+
+std::string config_path() {
+    const char * home = std::getenv("HOME");
+    return (home ? fs::path(home) / ".op-prime-number": fs::path(".op-prime-number")).string();
+}
+
+void calibrate(long nproc) {
+    std::cout << "Calibrating for " << nproc << " processes..." << std::endl;
+    const auto thresholds = Prime::calibrate(nproc);
+    std::cout << "parallel check from: ";
+    if (thresholds.parallel_min == std::numeric_limits<numeric_t>::max())
+        std::cout << "never" << std::endl;
+    else
+        std::cout << thresholds.parallel_min << std::endl;
+    std::cout << "miller-rabin from:   ";
+    if (thresholds.miller_rabin_min == std::numeric_limits<numeric_t>::max())
+        std::cout << "never" << std::endl;
+    else
+        std::cout << thresholds.miller_rabin_min << std::endl;
+    std::cout << "pollard rho from:    ";
+    if (thresholds.rho_min == std::numeric_limits<numeric_t>::max())
+        std::cout << "never" << std::endl;
+    else
+        std::cout << thresholds.rho_min << std::endl;
+    if (!Prime::save_thresholds(config_path())) {
+        std::cerr << "Can't save thresholds to " << config_path() << std::endl;
+        std::exit(EXIT_FAILURE);
+    }
+    std::cout << "saved to " << config_path() << std::endl;
+}
@@ -1,4 +1,9 @@
+#include <chrono>
+#include <limits>
+#include <sstream>
+
 #include "primes.h"
+#include "profiler.h"
 
 namespace fs = std::experimental::filesystem;
 
@@ -22,37 +27,72 @@ void handler(int sig);
 // Возвращаемы параметрые: НОД чисел 'a' и 'b'.
 static numeric_t gcd (numeric_t a, numeric_t b);
 
-// static numeric_t custom_mul(numeric_t param, numeric_t mod) - функция возвращающая результат
-// умножения числа param и param + 1 по модулю mod;
-static numeric_t custom_mul(numeric_t param, numeric_t mod);
+// static numeric_t mul_mod(numeric_t a, numeric_t b, numeric_t mod) - функция возвращающая
+// произведение a и b по модулю mod. Умножение идет в 128 битах и не переполняется;
+static numeric_t mul_mod(numeric_t a, numeric_t b, numeric_t mod);
+
+// static numeric_t custom_mul(numeric_t param, numeric_t c, numeric_t mod) - функция возвращающая
+// значение param * param + c по модулю mod;
+static numeric_t custom_mul(numeric_t param, numeric_t c, numeric_t mod);
+
+// static bool trial_division(numeric_t num) - функция проверки числа на простоту пробным делением.
+// Принимаемые параметры : num --- проверяемое число;
+// Возвращаемые параметры: true, если num простое число, false - в противном случае
+static bool trial_division(numeric_t num);
+
+// static bool miller_rabin(numeric_t num) - функция проверки числа на простоту тестом Миллера - Рабина.
+// Для чисел меньше 2^64 проверка по первым двенадцати простым основаниям дает точный ответ.
+// Принимаемые параметры : num --- проверяемое число;
+// Возвращаемые параметры: true, если num простое число, false - в противном случае
+static bool miller_rabin(numeric_t num);
 
 // static std::set<numeric_t> simple_factor(numeric_t num) - функция реализующая происк
-// простых делителей числа num простым пробным делением.
+// простых делителей числа num простым пробным делением до корня из num.
 // Принимаемые параметры : num --- число которое следует факторизовать;
 // Возвращаемые параметры: множество простых делителей числа num типа std::set<numeric_t>
 static std::set<numeric_t> simple_factor(numeric_t num);
 
-// static numeric_t pollard_rho(numeric_t number) - алгоритм факторизации числа Полларда - ро
+// static numeric_t pollard_rho(numeric_t num, numeric_t c) - алгоритм факторизации числа Полларда - ро
+// с многочленом x * x + c.
 // Принимаемые параметры : num --- число, первый делитель которого следует найти;
-// Возвращаемые параметры: первый делитель числа num.
-static numeric_t pollard_rho(numeric_t num);
+//                         c   --- свободный член многочлена;
+// Возвращаемые параметры: первый делитель числа num, либо само num, если разделить не удалось.
+static numeric_t pollard_rho(numeric_t num, numeric_t c);
+
+// static std::set<numeric_t> rho_factor(numeric_t num) - функция реализующая поиск
+// простых делителей числа num методом Полларда - ро.
+// Принимаемые параметры : num --- число которое следует факторизовать;
+// Возвращаемые параметры: множество делителей числа num типа std::set<numeric_t>
+static std::set<numeric_t> rho_factor(numeric_t num);
+
+// static double measure(F f) - функция замеряющая время работы f. Каждый замер повторяет f не
+// менее 5 мс, чтобы время быстрых вызовов не терялось в точности часов.
+// Принимаемые параметры : f --- замеряемая функция без параметров;
+// Возвращаемые параметры: наименьшее из нескольких замеров среднее время одного вызова f в секундах.
+template <typename F>
+static double measure(F f);
+
+// Таблица малых простых, используемых для предварительной проверки перед запуском процессов.
+// Деление на 2 проверяется всегда, так как процессы перебирают только нечетные делители.
+static const numeric_t small_primes[] = {
+        2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53, 59, 61, 67, 71, 73, 79, 83, 89, 97
+};
+static const std::size_t small_primes_count = sizeof(small_primes) / sizeof(small_primes[0]);
+
+static Thresholds thresholds_;
 
 
 // ----------------------------------- Реализация методов класса Prime -------------------------------------------------
 
 // bool Primes::is_prime(numeric_t num) - метод реализует алгоритм
-// проверки числа на простоту.
+// проверки числа на простоту: пробным делением, а начиная с порога miller_rabin_min
+// тестом Миллера - Рабина.
 // Принимаемые параметры:  num типа numeric_t(псевдоним числового типа).
 // Возвращаемые параметры: true, если num простое число, false - в противном случае
 bool Prime::is_prime(numeric_t num) noexcept {
-    numeric_t mod = std::abs(num);
-    if ((mod != 2 && num % 2 == 0) || mod == 1 || mod == 0)
-        return false;
-    NumericRange range(3, static_cast<numeric_t>(std::sqrt(mod)) + 1);
-    for (auto it = range.begin(); it < range.end(); it += 2)
-        if (num % (*it) == 0)
-            return false;
-    return true;
+    if (std::abs(num) >= thresholds_.miller_rabin_min)
+        return miller_rabin(num);
+    return trial_division(num);
 }
 
 
@@ -65,13 +105,15 @@ static volatile sig_atomic_t prime;
 //                         nproc --- колличество процессов
 // Возвращаемые параметры: true, если num простое число, false - в противном случае
 bool Prime::is_prime(numeric_t num, long nproc) noexcept {
-    if (nproc <= 0 || nproc == 1 || std::abs(num) < 1000000)
+    auto parallel_min = (nproc == thresholds_.nproc ? thresholds_.parallel_min: Thresholds{}.parallel_min);
+    if (nproc <= 0 || nproc == 1 || std::abs(num) < parallel_min || std::abs(num) >= thresholds_.miller_rabin_min)
         return Prime::is_prime(num);
 
     numeric_t mod = std::abs(num);
-    if (mod % 2 == 0 || mod % 3 == 0 || mod % 5 == 0 || mod % 7 == 0 || mod % 11 == 0 ||
-        mod % 13 == 0 || mod % 17 == 0 || mod % 19 == 0 || mod % 23 == 0 || mod % 29 == 0)
-        return false;
+    auto prefilter = std::max<std::size_t>(std::min(thresholds_.prefilter, small_primes_count), 1);
+    for (std::size_t i = 0; i < prefilter; ++i)
+        if (mod != small_primes[i] && mod % small_primes[i] == 0)
+            return false;
 
     prime = true;
     NumericRange range(3, static_cast<numeric_t>(std::sqrt(mod)) + 1);
@@ -141,23 +183,165 @@ bool Prime::is_prime(numeric_t num, long nproc) noexcept {
 // метод, возвращающий множество простых делителей числа типа std::set<numeric_t>.
 std::set<numeric_t> Prime::factorization(numeric_t num) {
     numeric_t mod = std::abs(num);
-    if (mod == 1 || Prime::is_prime(mod))
+    bool prime_num;
+    {
+        Profiler::Scope scope(Profiler::phase::primality);
+        prime_num = Prime::is_prime(mod);
+    }
+    if (mod == 1 || prime_num)
         return {num};
     if (mod == 0) return {};
-    if (mod < 1000000)
+    if (mod < thresholds_.rho_min) {
+        Profiler::Scope scope(Profiler::phase::trial_factor);
         return simple_factor(num);
+    }
+    Profiler::Scope scope(Profiler::phase::rho);
+    return rho_factor(num);
+}
 
-    std::set<numeric_t> result;
-    while (mod != 1) {
-        numeric_t divider = pollard_rho(mod);
-        mod /= divider;
-        result.insert(divider);
+// bool Prime::load_thresholds(const std::string & path) - метод, загружающий пороги выбора
+// алгоритмов из файла path. Файл состоит из строк вида "ключ = значение" (пробелы вокруг '='
+// необязательны), пустые строки и строки начинающиеся с '#' пропускаются. О строках с неизвестным
+// ключом или неверным значением выводится предупреждение в std::cerr, такие строки пропускаются.
+// Принимаемые параметры:  path --- путь к файлу настроек;
+// Возвращаемые параметры: true, если файл прочитан, false - если файл не удалось открыть.
+bool Prime::load_thresholds(const std::string & path) {
+    std::ifstream in(path);
+    if (!in)
+        return false;
+    auto trim = [] (const std::string & s) {
+        auto first = s.find_first_not_of(" \t\r");
+        if (first == std::string::npos)
+            return std::string{};
+        return s.substr(first, s.find_last_not_of(" \t\r") - first + 1);
+    };
+    std::string line;
+    for (std::size_t line_num = 1; std::getline(in, line); ++line_num) {
+        auto text = trim(line);
+        if (text.empty() || text[0] == '#')
+            continue;
+        auto delim = text.find('=');
+        std::string key = trim(text.substr(0, delim));
+        std::string value_str = (delim == std::string::npos ? "": trim(text.substr(delim + 1)));
+        numeric_t value = -1;
+        std::size_t parsed = 0;
+        try {
+            value = std::stoll(value_str, &parsed);
+        }
+        catch (std::logic_error & e) {
+            parsed = 0;
+        }
+        bool known = (key == "nproc" || key == "parallel_min" || key == "miller_rabin_min" ||
+                      key == "rho_min" || key == "prefilter");
+        if (!known || parsed == 0 || parsed != value_str.size() || value < 0) {
+            std::cerr << path << ":" << line_num << ": '" << line << "' "
+                      << (known ? "Wrong value, a non-negative integer is required.": "Unknown key.")
+                      << " Line skipped." << std::endl;
+            continue;
+        }
+        if (key == "nproc")
+            thresholds_.nproc = static_cast<long>(value);
+        else if (key == "parallel_min")
+            thresholds_.parallel_min = value;
+        else if (key == "miller_rabin_min")
+            thresholds_.miller_rabin_min = value;
+        else if (key == "rho_min")
+            thresholds_.rho_min = value;
+        else
+            thresholds_.prefilter = static_cast<std::size_t>(value);
     }
-    if (num < 0) {
-        auto key = *result.begin();
-        result.erase(key);
-        result.insert(-key);
+    return true;
+}
+
+// bool Prime::save_thresholds(const std::string & path) - метод, сохраняющий текущие пороги
+// выбора алгоритмов в файл path в формате, который читает Prime::load_thresholds().
+// Принимаемые параметры:  path --- путь к файлу настроек;
+// Возвращаемые параметры: true, если файл записан, false - в противном случае.
+bool Prime::save_thresholds(const std::string & path) {
+    std::ofstream out(path);
+    if (!out)
+        return false;
+    out << "# op-prime-number calibration" << std::endl
+        << "nproc = "            << thresholds_.nproc            << std::endl
+        << "parallel_min = "     << thresholds_.parallel_min     << std::endl
+        << "miller_rabin_min = " << thresholds_.miller_rabin_min << std::endl
+        << "rho_min = "          << thresholds_.rho_min          << std::endl
+        << "prefilter = "        << thresholds_.prefilter        << std::endl;
+    return static_cast<bool>(out);
+}
+
+// Thresholds Prime::calibrate(long nproc) - метод, подбирающий пороги выбора алгоритмов
+// замерами на данной машине. Для простых чисел вблизи 10^k сравнивается время проверки пробным
+// делением и тестом Миллера - Рабина, затем (ниже найденного порога) время последовательной и
+// параллельной проверки пробным делением, а для составных чисел вблизи 10^k - время факторизации
+// пробным делением и методом Полларда - ро. Порогом становится первый порядок, начиная с которого
+// второй алгоритм выигрывает на двух порядках подряд, так что единичный выброс замера не сдвигает
+// порог. Длина предварительной проверки не подбирается: ее цена (одно деление) всегда на порядки
+// меньше цены запуска процессов, которую она экономит, поэтому она сохраняется из текущих порогов
+// (заданная вручную в файле настроек длина не сбрасывается). Найденные пороги сразу становятся текущими.
+// Принимаемые параметры:  nproc --- колличество процессов для параллельной проверки;
+// Возвращаемые параметры: найденные пороги.
+Thresholds Prime::calibrate(long nproc) {
+    Thresholds result;
+    result.nproc = nproc;
+    result.prefilter = thresholds_.prefilter;
+    auto first_prime = [] (numeric_t from) {
+        while (!miller_rabin(from))
+            ++from;
+        return from;
+    };
+    // Возвращает первый порядок 10^k, k из [from, to], начиная с которого second быстрее first
+    // на двух порядках подряд, либо numeric_limits<numeric_t>::max(), если такого нет.
+    auto crossover = [] (int from, int to, auto first, auto second) {
+        numeric_t magnitude = 1, candidate = 0;
+        for (int k = 0; k < from; ++k)
+            magnitude *= 10;
+        for (int k = from; k <= to; ++k, magnitude *= 10) {
+            if (measure([&] { second(magnitude); }) >= measure([&] { first(magnitude); }))
+                candidate = 0;
+            else if (candidate == 0)
+                candidate = magnitude;
+            else
+                return candidate;
+        }
+        return std::numeric_limits<numeric_t>::max();
+    };
+
+    result.miller_rabin_min = crossover(2, 18,
+            [&] (numeric_t m) { trial_division(first_prime(m)); },
+            [&] (numeric_t m) { miller_rabin(first_prime(m)); });
+
+    // Параллельная проверка сравнивается с последовательной только ниже порога теста Миллера - Рабина,
+    // выше него пробное деление не используется.
+    result.parallel_min = std::numeric_limits<numeric_t>::max();
+    if (nproc > 1) {
+        int last = 4;
+        for (numeric_t m = 10000; last < 18 && m * 10 <= result.miller_rabin_min; m *= 10)
+            ++last;
+
+        // Процессы проверки пишут отчет в std::cout, на время замеров отключаем вывод.
+        std::cout.flush();
+        auto cout_buf = std::cout.rdbuf(nullptr);
+        thresholds_.nproc = nproc;
+        thresholds_.parallel_min = 0;
+        thresholds_.miller_rabin_min = std::numeric_limits<numeric_t>::max();
+        result.parallel_min = crossover(4, last,
+                [&] (numeric_t m) { trial_division(first_prime(m)); },
+                [&] (numeric_t m) { Prime::is_prime(first_prime(m), nproc); });
+        std::cout.rdbuf(cout_buf);
     }
+
+    result.rho_min = crossover(4, 14,
+            [&] (numeric_t m) {
+                auto p = first_prime(static_cast<numeric_t>(std::sqrt(m)));
+                simple_factor(p * first_prime(m / p + 1));
+            },
+            [&] (numeric_t m) {
+                auto p = first_prime(static_cast<numeric_t>(std::sqrt(m)));
+                rho_factor(p * first_prime(m / p + 1));
+            });
+
+    thresholds_ = result;
     return result;
 }
 
@@ -180,6 +364,17 @@ const NumericIterator NumericIterator::operator++(int) {
     return ret;
 }
 
+NumericIterator& NumericIterator::operator--() {
+    --num_;
+    return *this;
+}
+
+const NumericIterator NumericIterator::operator--(int) {
+    NumericIterator ret(num_);
+    --(*this);
+    return ret;
+}
+
 NumericIterator& NumericIterator::operator+=(numeric_t n) {
     num_ += n;
     return *this;
@@ -253,13 +448,18 @@ void handler(int sig) {
 
 static std::set<numeric_t> simple_factor(numeric_t num) {
     numeric_t mod = std::abs(num);
-    if (mod == 1 || Prime::is_prime(mod))
+    if (mod == 1)
         return {num};
     if (mod == 0) return {};
     std::set<numeric_t> result;
-    NumericRange range(2, mod / 2 + 1);
-    std::copy_if(range.begin(), range.end(), std::inserter(result, result.begin()),
-                 [&] (numeric_t n) { return mod % n == 0 && Prime::is_prime(n); });
+    for (numeric_t n = 2; n <= mod / n; n += (n == 2 ? 1 : 2))
+        if (mod % n == 0) {
+            result.insert(n);
+            while (mod % n == 0)
+                mod /= n;
+        }
+    if (mod != 1)
+        result.insert(mod);
     if (num < 0) {
         auto key = *result.begin();
         result.erase(key);
@@ -276,16 +476,112 @@ static numeric_t gcd (numeric_t a, numeric_t b) {
     return a;
 }
 
-static numeric_t custom_mul(numeric_t param, numeric_t mod){
-    return ((param % mod * (param + 1) % mod) % mod);
+static numeric_t mul_mod(numeric_t a, numeric_t b, numeric_t mod) {
+    __extension__ using uint128_t = unsigned __int128;
+    return static_cast<numeric_t>(static_cast<uint128_t>(a) * static_cast<uint128_t>(b) % static_cast<uint128_t>(mod));
+}
+
+static numeric_t custom_mul(numeric_t param, numeric_t c, numeric_t mod){
+    return (mul_mod(param, param, mod) + c) % mod;
+}
+
+static bool trial_division(numeric_t num) {
+    numeric_t mod = std::abs(num);
+    if ((mod != 2 && num % 2 == 0) || mod == 1 || mod == 0)
+        return false;
+    NumericRange range(3, static_cast<numeric_t>(std::sqrt(mod)) + 1);
+    for (auto it = range.begin(); it < range.end(); it += 2)
+        if (num % (*it) == 0)
+            return false;
+    return true;
+}
+
+static bool miller_rabin(numeric_t num) {
+    numeric_t mod = std::abs(num);
+    if (mod < 2)
+        return false;
+    for (numeric_t p: {2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37})
+        if (mod % p == 0)
+            return mod == p;
+
+    numeric_t d = mod - 1;
+    int s = 0;
+    for (; d % 2 == 0; ++s)
+        d /= 2;
+    for (numeric_t a: {2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37}) {
+        numeric_t x = 1, base = a;
+        for (numeric_t e = d; e; e /= 2, base = mul_mod(base, base, mod))
+            if (e % 2)
+                x = mul_mod(x, base, mod);
+        if (x == 1 || x == mod - 1)
+            continue;
+        int r = 1;
+        for (; r < s; ++r) {
+            x = mul_mod(x, x, mod);
+            if (x == mod - 1)
+                break;
+        }
+        if (r == s)
+            return false;
+    }
+    return true;
+}
+
+static std::set<numeric_t> rho_factor(numeric_t num) {
+    numeric_t mod = std::abs(num);
+    std::set<numeric_t> result;
+    while (mod != 1) {
+        if (miller_rabin(mod)) {
+            result.insert(mod);
+            break;
+        }
+        numeric_t divider = mod;
+        for (numeric_t c = 1; c <= 20 && divider == mod; ++c)
+            divider = pollard_rho(mod, c);
+        if (divider == mod) {                   // Метод не смог разделить число, раскладываем пробным делением
+            auto rest = simple_factor(mod);
+            result.insert(rest.begin(), rest.end());
+            break;
+        }
+        mod /= divider;
+        if (miller_rabin(divider))
+            result.insert(divider);
+        else {                                  // Найденный делитель составной, раскладываем его дальше
+            auto rest = rho_factor(divider);
+            result.insert(rest.begin(), rest.end());
+        }
+    }
+    if (num < 0) {
+        auto key = *result.begin();
+        result.erase(key);
+        result.insert(-key);
+    }
+    return result;
+}
+
+template <typename F>
+static double measure(F f) {
+    double best = std::numeric_limits<double>::max();
+    for (int i = 0; i < 3; ++i) {
+        unsigned long runs = 0;
+        auto start = std::chrono::steady_clock::now();
+        std::chrono::duration<double> elapsed{};
+        do {
+            f();
+            ++runs;
+            elapsed = std::chrono::steady_clock::now() - start;
+        } while (elapsed.count() < 0.005);
+        best = std::min(best, elapsed.count() / runs);
+    }
+    return best;
 }
 
-static numeric_t pollard_rho(numeric_t num){
+static numeric_t pollard_rho(numeric_t num, numeric_t c){
     numeric_t a = 2, b = 2, ret{};
     while (true)
     {
-        a = custom_mul(a, num);
-        b = custom_mul(custom_mul(b, num), num);
+        a = custom_mul(a, c, num);
+        b = custom_mul(custom_mul(b, c, num), c, num);
         ret = gcd(std::abs(b - a), num);
         if (ret > 1)
             break;
@@ -18,16 +18,35 @@
 #include <unistd.h>
 #include <wait.h>
 #include <string.h>
+#include <string>
+#include <limits>
 
 using numeric_t = long long;
 
 
+// Пороги выбора алгоритмов. Значения по умолчанию подходят для большинства машин, parallel_min,
+// miller_rabin_min и rho_min подбираются под конкретную машину методом Prime::calibrate().
+// parallel_min действует только при проверке в nproc процессов, для другого числа процессов
+// используется значение по умолчанию.
+struct Thresholds {
+    long        nproc            = 0;        // колличество процессов, для которого подобран parallel_min
+    numeric_t   parallel_min     = 1000000;  // с этого модуля числа проверка на простоту идет в nproc процессов
+    numeric_t   miller_rabin_min = std::numeric_limits<numeric_t>::max();  // с этого модуля числа проверка
+                                                                          // идет тестом Миллера - Рабина
+    numeric_t   rho_min          = 1000000;  // с этого модуля числа факторизация идет методом Полларда - ро
+    std::size_t prefilter        = 10;       // сколько малых простых проверяется до запуска процессов
+};
+
 class Prime {
 public:
     static bool is_prime(numeric_t num)             noexcept;
     static bool is_prime(numeric_t num, long nproc) noexcept;
 
     static std::set<numeric_t> factorization(numeric_t num);
+
+    static bool load_thresholds(const std::string & path);
+    static bool save_thresholds(const std::string & path);
+    static Thresholds calibrate(long nproc);
 };
 
 class NumericIterator {
@@ -37,6 +56,8 @@ public:
 
     NumericIterator & operator ++ ();
     const NumericIterator operator ++ (int);
+    NumericIterator & operator -- ();
+    const NumericIterator operator -- (int);
     NumericIterator & operator += (numeric_t n);
     NumericIterator & operator -= (numeric_t n);
     NumericIterator operator + (numeric_t n) const;
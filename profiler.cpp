@@ -0,0 +1,214 @@
+#include <chrono>
+#include <vector>
+#include <string>
+#include <iomanip>
+#include <cerrno>
+#include <cstring>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "profiler.h"
+
+// Аппаратные счетчики, собираемые для каждого этапа.
+static const std::uint64_t events[] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+};
+static const char * event_names[] = {"cycles", "instructions", "cache-misses", "branch-misses"};
+static const char * phase_names[] = {"other", "parse", "primality", "trial factor", "rho", "output"};
+
+constexpr std::size_t events_count = sizeof(events) / sizeof(events[0]);
+constexpr std::size_t phases_count = static_cast<std::size_t>(Profiler::phase::count);
+
+// Снимок состояния счетчиков и часов. Значения счетчиков хранятся без масштабирования вместе
+// со временем, в течение которого группа была включена и реально считала.
+struct Snapshot {
+    std::uint64_t counters[events_count]{};
+    std::uint64_t time_enabled{};
+    std::uint64_t time_running{};
+    std::chrono::steady_clock::time_point time;
+};
+
+// Накопленные значения по одному этапу.
+struct PhaseTotal {
+    std::uint64_t counters[events_count]{};
+    double        wall{};
+    unsigned long calls{};
+};
+
+// Формат чтения группы счетчиков: PERF_FORMAT_GROUP | TOTAL_TIME_ENABLED | TOTAL_TIME_RUNNING.
+struct GroupRead {
+    std::uint64_t nr;
+    std::uint64_t time_enabled;
+    std::uint64_t time_running;
+    std::uint64_t values[events_count];
+};
+
+static bool                             enabled_ = false;
+static int                              leader_ = -1;            // ведущий счетчик группы
+static bool                             available_[events_count]{};
+static int                              open_error_ = 0;
+static bool                             multiplexed_ = false;    // счетчики делили PMU с другими событиями
+static bool                             scheduled_ = false;      // группа хотя бы раз считала
+static int                              read_error_ = 0;
+static PhaseTotal                       totals_[phases_count];
+static std::vector<Profiler::phase>     stack_;
+static Snapshot                         last_;
+
+// static int open_counter(std::uint64_t config, int group) - функция открывающая аппаратный счетчик
+// config для текущего процесса в группе group. Считаются только события пользовательского режима,
+// что разрешено и при perf_event_paranoid = 2.
+// Принимаемые параметры : config --- тип события PERF_COUNT_HW_*;
+//                         group  --- дескриптор ведущего счетчика группы, -1 для нового ведущего;
+// Возвращаемые параметры: дескриптор счетчика или -1, если счетчик недоступен.
+static int open_counter(std::uint64_t config, int group);
+
+// static Snapshot take_snapshot() - функция снимающая текущие показания счетчиков и часов.
+// Счетчики группы читаются одним вызовом read(). При ошибке чтения остаются прежние показания.
+static Snapshot take_snapshot();
+
+// static void account(const Snapshot & now) - процедура, относящая показания накопленные с
+// последнего снимка к этапу на вершине стека. Если за это время группа работала не все время
+// (ядро делило PMU между событиями), приращения масштабируются на долю времени работы.
+static void account(const Snapshot & now);
+
+
+// ----------------------------------- Реализация методов класса Profiler ----------------------------------------------
+
+// void Profiler::enable() - метод включает профилирование и открывает счетчики. Если счетчики
+// недоступны (нет поддержки в ядре, виртуальная машина, запрет perf_event_paranoid), то
+// профилирование продолжается только по времени работы.
+void Profiler::enable() {
+    if (enabled_)
+        return;
+    for (std::size_t i = 0; i < events_count; ++i) {
+        int fd = open_counter(events[i], leader_);
+        if (fd == -1)
+            continue;
+        available_[i] = true;
+        if (leader_ == -1)
+            leader_ = fd;
+    }
+    stack_.assign(1, phase::other);
+    last_ = take_snapshot();
+    enabled_ = true;
+}
+
+// void Profiler::report(std::ostream & out, bool forked) - метод выводит в поток out таблицу по
+// этапам: число вызовов, время работы и значения счетчиков. Недоступные счетчики выводятся как n/a.
+// Принимаемые параметры: out    --- поток для вывода;
+//                        forked --- проверка шла в несколько процессов (опция --scale).
+void Profiler::report(std::ostream & out, bool forked) {
+    if (!enabled_)
+        return;
+    account(take_snapshot());
+
+    auto flags = out.flags();
+    out << std::left << std::setw(14) << "phase" << std::right << std::setw(12) << "calls" << std::setw(12) << "wall, s";
+    for (auto name: event_names)
+        out << std::setw(16) << name;
+    out << std::endl;
+
+    for (std::size_t p = 0; p < phases_count; ++p) {
+        const auto & total = totals_[p];
+        out << std::left << std::setw(14) << phase_names[p] << std::right << std::setw(12) << total.calls
+            << std::setw(12) << std::fixed << std::setprecision(6) << total.wall;
+        for (std::size_t i = 0; i < events_count; ++i) {
+            if (available_[i] && scheduled_)
+                out << std::setw(16) << total.counters[i];
+            else
+                out << std::setw(16) << "n/a";
+        }
+        out << std::endl;
+    }
+    out.flags(flags);
+    if (open_error_)
+        out << "Some hardware counters are unavailable: " << strerror(open_error_) << std::endl;
+    if (leader_ != -1 && !scheduled_)
+        out << "Hardware counters were opened but never scheduled by the kernel." << std::endl;
+    if (read_error_)
+        out << "Reading hardware counters failed, values are incomplete: " << strerror(read_error_) << std::endl;
+    if (multiplexed_)
+        out << "Counters were multiplexed, values are scaled estimates." << std::endl;
+    if (forked)
+        out << "Counters cover this process only, work of the processes created by --scale is counted "
+               "in wall time of the primality phase." << std::endl;
+}
+
+Profiler::Scope::Scope(phase p): active_{enabled_} {
+    if (!active_)
+        return;
+    account(take_snapshot());
+    stack_.push_back(p);
+    ++totals_[static_cast<std::size_t>(p)].calls;
+}
+
+Profiler::Scope::~Scope() {
+    if (!active_)
+        return;
+    account(take_snapshot());
+    stack_.pop_back();
+}
+
+// ---------------------------------------------------------------------------------------------------------------------
+
+
+
+// --------------------- Реализация статических вспомогательных функций -----------------------------------------------
+
+static int open_counter(std::uint64_t config, int group) {
+    perf_event_attr attr{};
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = config;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    auto fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, group, 0));
+    if (fd == -1)
+        open_error_ = errno;
+    return fd;
+}
+
+static Snapshot take_snapshot() {
+    Snapshot snapshot = last_;
+    GroupRead group{};
+    if (leader_ != -1) {
+        if (read(leader_, &group, sizeof(group)) > 0) {
+            snapshot.time_enabled = group.time_enabled;
+            snapshot.time_running = group.time_running;
+            // Значения в группе идут в порядке открытия, то есть по доступным счетчикам.
+            std::size_t slot = 0;
+            for (std::size_t i = 0; i < events_count && slot < group.nr; ++i)
+                if (available_[i])
+                    snapshot.counters[i] = group.values[slot++];
+        }
+        else
+            read_error_ = errno;
+    }
+    snapshot.time = std::chrono::steady_clock::now();
+    return snapshot;
+}
+
+static void account(const Snapshot & now) {
+    auto & total = totals_[static_cast<std::size_t>(stack_.back())];
+    auto enabled = now.time_enabled > last_.time_enabled ? now.time_enabled - last_.time_enabled: 0;
+    auto running = now.time_running > last_.time_running ? now.time_running - last_.time_running: 0;
+    if (running != 0) {
+        scheduled_ = true;
+        double scale = 1.0;
+        if (running < enabled) {
+            scale = static_cast<double>(enabled) / static_cast<double>(running);
+            multiplexed_ = true;
+        }
+        for (std::size_t i = 0; i < events_count; ++i)
+            if (now.counters[i] > last_.counters[i]) {
+                auto delta = static_cast<double>(now.counters[i] - last_.counters[i]);
+                total.counters[i] += static_cast<std::uint64_t>(delta * scale);
+            }
+    }
+    total.wall += std::chrono::duration<double>(now.time - last_.time).count();
+    last_ = now;
+}
+
+// ---------------------------------------------------------------------------------------------------------------------
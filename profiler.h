@@ -0,0 +1,33 @@
+// profiler.h --- класс профилирования основных этапов работы программы. Для каждого этапа
+//                собирает время работы и аппаратные счетчики процессора (perf_event_open)
+
+#ifndef OP_PRIME_NUMBER_PROFILER_H
+#define OP_PRIME_NUMBER_PROFILER_H
+
+#include <iostream>
+#include <cstdint>
+
+
+class Profiler {
+public:
+    // Этапы работы программы. other --- все, что не относится к остальным этапам.
+    enum class phase {other, parse, primality, trial_factor, rho, output, count};
+
+    static void enable();
+    static void report(std::ostream & out, bool forked = false);
+
+    // Область профилирования. Пока объект существует, время и счетчики относятся к этапу p,
+    // вложенная область приостанавливает учет внешней.
+    class Scope {
+    public:
+        explicit Scope(phase p);
+        ~Scope();
+
+        Scope(const Scope &) = delete;
+        Scope & operator = (const Scope &) = delete;
+    private:
+        bool active_;
+    };
+};
+
+#endif //OP_PRIME_NUMBER_PROFILER_H